@@ -1,8 +1,12 @@
+// glibc only honors this if defined before its first header
+#define _GNU_SOURCE
+
 #ifndef UTIL_IMPL
 #define UTIL_IMPL
 #include <stdio.h>
 #endif // ifndef UTIL_IMPL
 
+#include <stdbool.h>
 #include "util/map.h"
 #include "reloadhost.h"
 
@@ -10,119 +14,2596 @@
 #include <string.h>
 #undef _POSIX_C_SOURCE
 
-#define _GNU_SOURCE
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
+
+extern char **environ;
 
 #define _STRINGIFY_IMPL(x) #x
 #define STRINGIFY(x) _STRINGIFY_IMPL(x)
 
+#define USAGE                                                              \
+    "usage: reloadhost [options] <module> [args...]\n"                     \
+    "       reloadhost [options] -m <manifest> [args...]\n"               \
+    "  -m <file>     host the modules listed in <file>, see README\n"     \
+    "  -s <file>     keep persistent state in <file>, see reload_host::alloc\n" \
+    "  -S <size>     size of persistent state in MiB (default 1024)\n"    \
+    "  -c <seconds>  checkpoint persistent state every <seconds>\n"     \
+    "  -g <steps>    steps a new version runs under fault guard (default 60)\n" \
+    "  -G <seconds>  grace period before unloading old versions (default 1)\n" \
+    "  -H <cpu>      pin host thread to <cpu>\n"                          \
+    "  -T <cpu>      pin step thread to <cpu> (worker i to <cpu> + i)\n"   \
+    "  -w <n>        run <n> worker processes forked after RH_INIT\n"     \
+    "  -b <command>  run <command> when sources change, reload when it succeeds\n" \
+    "  -d <dir>      source directory watched with -b (default .), repeatable\n"
+
 typedef struct {
     char *name;
     void *storage;
 } func_storage_t;
 
-// persistent data exposed to client
-static reload_host_t rh;
+#define MAX_BUILD_DIRS 16
+
+// command line options
+static struct {
+    const char *manifest_path, *state_path;
+    size_t state_size;
+    double checkpoint_interval;
+    int guard_steps;
+    double unload_grace;
+    int host_cpu, step_cpu;
+    int workers;
+    const char *build_cmd, *build_dirs[MAX_BUILD_DIRS];
+    int nbuild_dirs;
+} opts = {
+    .state_size = 1024ull << 20,
+    .guard_steps = 60,
+    .unload_grace = 1.0,
+    .host_cpu = -1,
+    .step_cpu = -1
+};
+
+#define MAX_MODULES 32
+
+typedef struct {
+    char *name, *path;
+
+    // arguments passed to f_rh_entry, argv[0] is path
+    int argc;
+    char **argv;
+
+    // indices of modules this one depends on, all of which come before it
+    int deps[MAX_MODULES];
+    size_t ndeps;
+
+    // persistent data exposed to client
+    reload_host_t rh;
+
+    // currently loaded version and its base address
+    void *handle, *base;
+    rh_entry_f func;
+
+    // last known good version, kept loaded while handle runs under fault
+    // guard so that it can be rolled back to. NULL when not guarding or when
+    // only reloaded because a dependency was.
+    void *prev_handle, *prev_base, *prev_userdata;
+    rh_entry_f prev_func;
+
+    // version loaded by host thread, taken by the step thread on
+    // PENDING_RELOAD
+    void *next_handle, *next_base;
+    rh_entry_f next_func;
+
+    // last seen modification time of path, host thread only
+    struct timespec mod_time;
+
+    // true while part of a reload, either because it changed or because one of
+    // its dependencies did
+    bool reloading;
+
+    // map of storage address -> char* function name
+    map_t funcs;
+} module_t;
+
+// hosted modules in dependency order
+static struct {
+    module_t list[MAX_MODULES];
+    size_t n;
+} modules;
+
+// fault guard, see guarded_call
+static struct {
+    sigjmp_buf env;
+    volatile sig_atomic_t sig;
+
+    // remaining guarded calls into module, 0 when not guarding
+    int calls;
+} guard;
+
+// true while this thread is in guarded_call, faults on any other thread are
+// fatal
+static _Thread_local volatile sig_atomic_t guard_active;
+
+// thread calling f_rh_entry
+static pthread_t step_thread;
+
+#define MAX_THREADS 256
+
+// marks unused slots in threads.slots
+#define EPOCH_UNUSED UINT64_MAX
+
+// registered client threads, see reload_host::thread_register
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t parked_cond, resume_cond;
+
+    // nonzero while the step thread waits for registered threads to park
+    atomic_int pending;
+
+    // incremented on every module swap
+    _Atomic uint64_t epoch;
+
+    // number of registered and parked threads, protected by lock
+    size_t registered, parked;
+
+    // epoch in which each thread registered, see modules_unload. own cache
+    // line each as it is read by safe_point() on every thread
+    struct {
+        _Atomic uint64_t epoch;
+        char pad[64 - sizeof(uint64_t)];
+    } slots[MAX_THREADS];
+} threads = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .parked_cond = PTHREAD_COND_INITIALIZER,
+    .resume_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// this thread's index in threads.slots, -1 if not registered
+static _Thread_local int thread_slot = -1;
+
+// modules swapped out at epoch which may still be running on client threads,
+// see modules_unload
+typedef struct {
+    void *handle;
+    uint64_t epoch;
+    struct timespec time;
+} retired_module_t;
+
+static struct {
+    retired_module_t *list;
+    size_t n, cap;
+} retired;
+
+// host thread wakes up this often to drain the queue and check the module
+#define HOST_INTERVAL_NS 5000000
+
+// requests from host thread to step thread, see host.pending
+enum {
+    PENDING_RELOAD = 1 << 0,
+    PENDING_CHECKPOINT = 1 << 1
+};
+
+// host services (change detection, loading, registry maintenance, logging)
+// run on their own thread, see host_main. the step thread only checks
+// host.pending once per step.
+static struct {
+    pthread_t thread;
+    bool running;
+    atomic_bool quit;
+
+    // owner of module registries, retired and the consumer side of queue.
+    // held by the host thread while it works and by the step thread while it
+    // reloads, rolls back or checkpoints.
+    pthread_mutex_t lock;
+
+    // PENDING_* bits, set by host thread and taken by step thread
+    atomic_int pending;
+
+    // true from publishing new versions until their guard period is over
+    bool reloading;
+} host = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// true if this thread holds host.lock
+static _Thread_local bool host_locked;
+
+#define MAX_WORKERS 256
+
+// reload command sent from supervisor to every worker, one per changed module
+// of a version, see supervise
+typedef struct {
+    uint32_t version, module;
+
+    // true for the last command of version
+    bool last;
+
+    // copy of the module made by the supervisor
+    char path[1024];
+} worker_cmd_t;
+
+// sent from every worker to the supervisor once a version is through its
+// guard period or rolled back
+typedef struct {
+    int worker;
+    uint32_t version;
+    bool ok;
+
+    // CLOCK_MONOTONIC time at which the new (ok) or previous (!ok) version
+    // started running again
+    struct timespec applied;
+
+    // time taken to roll back, if !ok
+    double recovery_ms;
+} worker_report_t;
+
+// pre-forked worker mode (-w)
+static struct {
+    // index of this worker process, -1 in the supervisor or without -w
+    int index;
+
+    // pipe for commands from and reports to the supervisor
+    int cmd_fd, report_fd;
+
+    // last command version published by the host thread
+    uint32_t version;
+
+    // command being read, commands of more than PIPE_BUF bytes may arrive in
+    // pieces. see worker_read.
+    worker_cmd_t cmd;
+    size_t cmd_len;
+
+    // true if a module of the version being read failed to load
+    bool failed;
+} worker = { .index = -1, .cmd_fd = -1, .report_fd = -1 };
+
+// sources are scanned this often with -b
+#define BUILD_SCAN_NS 50000000
+
+// a build starts once sources have not changed for this long, so that saving
+// several files at once only builds once
+#define BUILD_DEBOUNCE_NS 150000000
+
+// CLOCK_MONOTONIC times of one edit -> build -> reload cycle
+typedef struct {
+    // 0 if none
+    uint32_t cycle;
+    struct timespec edited, started, finished;
+} build_cycle_t;
+
+// integrated build driver (-b), owned by the host thread or by the supervisor
+// with -w, see build_poll
+static struct {
+    // newest modification time and number of sources at the last scan
+    struct timespec newest;
+    size_t count;
+    struct timespec scanned;
+
+    // true if sources changed since the last build started, changed is when
+    // that was noticed and edited when the newest source was written
+    bool dirty;
+    struct timespec changed, edited;
+
+    // running build (pid > 0) and its cycle
+    pid_t pid;
+    build_cycle_t current;
+
+    // last successful build, check is true until modules have been checked
+    // for what it wrote
+    build_cycle_t done;
+    bool check;
 
-// currently loaded module
-static void *module = NULL;
+    // cycle whose new versions were published and are yet to be reported on
+    // by the step thread, guarded by host.lock
+    build_cycle_t applying;
+} build;
 
-// map of storage address -> char* function name
-static map_t funcs;
+typedef enum {
+    MSG_REG,
+    MSG_DEL,
+    MSG_LOG,
+    MSG_ERR,
+    MSG_REPORT
+} msg_type;
+
+typedef struct {
+    msg_type type;
+
+    // MSG_REG, MSG_DEL: storage address and (MSG_REG) function address
+    void **p;
+    void *addr;
+
+    union {
+        // MSG_LOG, MSG_ERR
+        char text[128];
+
+        // MSG_REPORT
+        worker_report_t report;
+    };
+} msg_t;
+
+#define QUEUE_SIZE 4096
+
+// single producer (step thread), single consumer (holder of host.lock) queue
+// for everything the step thread hands off to the host thread
+static struct {
+    msg_t msgs[QUEUE_SIZE];
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+} queue;
+
+// persistent state is mapped here. the address must be the same across runs
+// as client state stores raw pointers into itself
+#define STATE_ADDR ((uintptr_t) 0x200000000000ull)
+
+// "RHSTATE2"
+#define STATE_MAGIC 0x3245544154534852ull
+
+// first page of persistent state
+typedef struct {
+    uint64_t magic, size, base;
+
+    // bump allocator offset, see state_alloc
+    uint64_t top;
+
+    // offset, capacity and used length of serialized function registry, see
+    // state_save_funcs
+    uint64_t funcs, funcs_cap, funcs_len;
+
+    // number of modules and their reload_host::userdata at last checkpoint
+    uint64_t nmodules;
+    void *userdata[MAX_MODULES];
+
+    // offsets of the names of those modules, which userdata and registry
+    // entries are matched to on restore, see state_match_modules
+    uint64_t names[MAX_MODULES];
+
+    // set by the first checkpoint, which happens once RH_INIT succeeds.
+    // state is reinitialized if the host never got that far.
+    uint64_t ready;
+} state_header_t;
+
+// journal file is a sequence of (uint64_t offset, page) records followed by
+// this trailer, which is only written once all records are
+typedef struct {
+    uint64_t magic, count;
+} journal_trailer_t;
+
+// persistent state, base == NULL if disabled
+static struct {
+    int fd, pagemap_fd;
+    const char *path;
+    char *base, *journal_path;
+    size_t size, page;
+    state_header_t *header;
+
+    // true if kernel soft-dirty bits are usable for dirty page tracking,
+    // otherwise every allocated page is written on checkpoint
+    bool soft_dirty;
+
+    // true in workers, which all have their own copy of state and neither
+    // checkpoint nor revert it
+    bool detached;
+
+    struct timespec last_checkpoint;
+} state = { .fd = -1, .pagemap_fd = -1 };
+
+// modification time of struct stat st
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec)
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#endif // ifdef __APPLE__
+
+static double timespec_diff(struct timespec a, struct timespec b) {
+    return (a.tv_sec - b.tv_sec) + ((a.tv_nsec - b.tv_nsec) / 1e9);
+}
+
+// prints the timings of build cycle c, whose new versions started running
+// (ok) or were rolled back (!ok) at applied
+static void build_cycle_report(
+    const build_cycle_t *c, bool ok, struct timespec applied) {
+    if (!ok) {
+        printf(
+            "cycle %u: new version rolled back, build took %.2f ms\n",
+            c->cycle, timespec_diff(c->finished, c->started) * 1000.0);
+    } else {
+        printf(
+            "cycle %u: edit->build %.2f ms, build %.2f ms, "
+            "build->running %.2f ms, edit->running %.2f ms\n",
+            c->cycle,
+            timespec_diff(c->started, c->edited) * 1000.0,
+            timespec_diff(c->finished, c->started) * 1000.0,
+            timespec_diff(applied, c->finished) * 1000.0,
+            timespec_diff(applied, c->edited) * 1000.0);
+    }
+
+    fflush(stdout);
+}
+
+static void host_drain();
+
+static void host_lock() {
+    pthread_mutex_lock(&host.lock);
+    host_locked = true;
+}
+
+static void host_unlock() {
+    host_locked = false;
+    pthread_mutex_unlock(&host.lock);
+}
+
+static void queue_push(const msg_t *msg) {
+    const size_t tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&queue.head, memory_order_acquire)
+            == QUEUE_SIZE) {
+        // full, drain it ourselves if we already own the consumer side
+        if (host_locked || !host.running) {
+            host_drain();
+        } else {
+            sched_yield();
+        }
+    }
+
+    queue.msgs[tail % QUEUE_SIZE] = *msg;
+    atomic_store_explicit(&queue.tail, tail + 1, memory_order_release);
+}
+
+// logs from step thread through host thread, to stderr if err. messages
+// longer than msg_t::text are sent in pieces, written back to back.
+static void host_log(bool err, const char *fmt, ...) {
+    char *body, *text;
+    va_list args;
+    va_start(args, fmt);
+    assert(vasprintf(&body, fmt, args) >= 0);
+    va_end(args);
+
+    if (worker.index >= 0) {
+        assert(asprintf(&text, "[worker %d] %s", worker.index, body) >= 0);
+        free(body);
+    } else {
+        text = body;
+    }
+
+    msg_t msg = { .type = err ? MSG_ERR : MSG_LOG };
+    const size_t len = strlen(text);
+    for (size_t i = 0; i < len; i += sizeof(msg.text) - 1) {
+        snprintf(msg.text, sizeof(msg.text), "%s", text + i);
+        queue_push(&msg);
+    }
+
+    free(text);
+}
+
+// processes all queued messages, host.lock must be held
+static void host_drain() {
+    const size_t tail = atomic_load_explicit(&queue.tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+
+    for (; head != tail; head++) {
+        const msg_t *msg = &queue.msgs[head % QUEUE_SIZE];
+        switch (msg->type) {
+        case MSG_REG: {
+            // registry of the module the function lives in
+            Dl_info info;
+            module_t *m = NULL;
+            if (dladdr(msg->addr, &info) && info.dli_sname) {
+                for (size_t i = 0; i < modules.n; i++) {
+                    if (info.dli_fbase == modules.list[i].base
+                        || info.dli_fbase == modules.list[i].prev_base) {
+                        m = &modules.list[i];
+                        break;
+                    }
+                }
+            }
+
+            if (!m) {
+                fprintf(
+                    stderr, "reg_fn: %p is not in a hosted module, ignoring\n",
+                    msg->addr);
+                break;
+            }
+
+            map_insert(&m->funcs, msg->p, strdup(info.dli_sname));
+            break;
+        }
+        case MSG_DEL:
+            for (size_t i = 0; i < modules.n; i++) {
+                map_remove(&modules.list[i].funcs, msg->p);
+            }
+            break;
+        case MSG_LOG:
+            fputs(msg->text, stdout);
+            break;
+        case MSG_ERR:
+            fputs(msg->text, stderr);
+            break;
+        case MSG_REPORT:
+            if (worker.index >= 0) {
+                assert(
+                    write(worker.report_fd, &msg->report, sizeof(msg->report))
+                        == sizeof(msg->report));
+            } else if (build.applying.cycle) {
+                build_cycle_report(
+                    &build.applying, msg->report.ok, msg->report.applied);
+                build.applying.cycle = 0;
+            }
+            break;
+        }
+    }
+
+    atomic_store_explicit(&queue.head, head, memory_order_release);
+}
 
 // see reload_host::reg_fn
 static void reg_fn(void **p) {
-    Dl_info info;
-    dladdr(*p, &info);
-    map_insert(&funcs, p, strdup(info.dli_sname));
+    queue_push(&(msg_t) { .type = MSG_REG, .p = p, .addr = *p });
 }
 
 // see reload_host::del_fn
 static void del_fn(void **p) {
-    map_remove(&funcs, p);
+    queue_push(&(msg_t) { .type = MSG_DEL, .p = p });
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("%s", "usage: reloadhost <module> [args...]");
+static bool state_contains(const void *p) {
+    return (const char*) p >= state.base
+        && (const char*) p < state.base + state.size;
+}
+
+// see reload_host::safe_point
+static void safe_point() {
+    if (thread_slot < 0) {
+        return;
     }
 
-    rh = (reload_host_t) {
-        .reg_fn = reg_fn,
-        .del_fn = del_fn,
-        .userdata = NULL
-    };
+    if (!atomic_load_explicit(&threads.pending, memory_order_acquire)) {
+        return;
+    }
 
-    map_init(
-        &funcs,
-        map_hash_id,
-        NULL,
-        NULL,
-        NULL,
-        map_cmp_id,
-        NULL,
-        map_default_free,
-        NULL);
+    pthread_mutex_lock(&threads.lock);
+    threads.parked++;
+    pthread_cond_signal(&threads.parked_cond);
 
-    struct timespec mod_time;
-    rh_entry_f func = NULL;
-    reload_host_op op = RH_INIT;
+    while (atomic_load_explicit(&threads.pending, memory_order_relaxed)) {
+        pthread_cond_wait(&threads.resume_cond, &threads.lock);
+    }
 
-    while (true) {
-        struct stat st;
-        assert(stat(argv[1], &st) >= 0);
+    threads.parked--;
+    pthread_mutex_unlock(&threads.lock);
+}
+
+// see reload_host::thread_register
+static void thread_register() {
+    if (thread_slot >= 0 || pthread_equal(pthread_self(), step_thread)) {
+        return;
+    }
+
+    pthread_mutex_lock(&threads.lock);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (atomic_load(&threads.slots[i].epoch) == EPOCH_UNUSED) {
+            atomic_store(&threads.slots[i].epoch, atomic_load(&threads.epoch));
+            thread_slot = i;
+            threads.registered++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&threads.lock);
+
+    assert(thread_slot >= 0);
+
+    // park right away if the step thread is already waiting on us
+    safe_point();
+}
+
+// see reload_host::thread_unregister
+static void thread_unregister() {
+    if (thread_slot < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&threads.lock);
+    atomic_store(&threads.slots[thread_slot].epoch, EPOCH_UNUSED);
+    thread_slot = -1;
+    threads.registered--;
+    pthread_cond_signal(&threads.parked_cond);
+    pthread_mutex_unlock(&threads.lock);
+}
+
+// waits until all registered threads are parked in safe_point()
+static void threads_stop() {
+    pthread_mutex_lock(&threads.lock);
+    atomic_store(&threads.pending, 1);
+    while (threads.parked < threads.registered) {
+        pthread_cond_wait(&threads.parked_cond, &threads.lock);
+    }
+}
+
+// resumes threads stopped by threads_stop(), starting a new epoch if modules
+// were swapped while they were parked
+static void threads_resume(bool swapped) {
+    if (swapped) {
+        atomic_fetch_add(&threads.epoch, 1);
+    }
+
+    atomic_store(&threads.pending, 0);
+    pthread_cond_broadcast(&threads.resume_cond);
+    pthread_mutex_unlock(&threads.lock);
+}
+
+// schedules handle for unloading once no client thread can be running it.
+// must be called after the epoch in which handle stopped being current has
+// ended, see threads_resume
+static void module_retire(void *handle) {
+    if (retired.n == retired.cap) {
+        retired.cap = retired.cap ? retired.cap * 2 : 4;
+        retired.list =
+            realloc(retired.list, retired.cap * sizeof(retired_module_t));
+    }
+
+    retired_module_t *r = &retired.list[retired.n++];
+    r->handle = handle;
+    r->epoch = atomic_load(&threads.epoch);
+    clock_gettime(CLOCK_MONOTONIC, &r->time);
+}
+
+// unloads retired modules once the grace period has passed and every thread
+// registered while they were current has unregistered. threads registered
+// since only run the versions that replaced them.
+static void modules_unload() {
+    if (!retired.n) {
+        return;
+    }
+
+    uint64_t min_epoch = UINT64_MAX;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        const uint64_t epoch =
+            atomic_load_explicit(
+                &threads.slots[i].epoch, memory_order_acquire);
+        if (epoch < min_epoch) {
+            min_epoch = epoch;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (size_t i = 0; i < retired.n;) {
+        retired_module_t *r = &retired.list[i];
+        if (min_epoch >= r->epoch
+            && timespec_diff(now, r->time) >= opts.unload_grace) {
+            assert(!dlclose(r->handle));
+            *r = retired.list[--retired.n];
+        } else {
+            i++;
+        }
+    }
+}
+
+// see reload_host::alloc
+static void *state_alloc(size_t n) {
+    const uint64_t top = (state.header->top + 15) & ~15ull;
+    if (top + n > state.size) {
+        return NULL;
+    }
+
+    state.header->top = top + n;
+    return state.base + top;
+}
+
+// clears soft-dirty bits of all pages, returns false if unsupported
+static bool soft_dirty_clear() {
+#ifdef __linux__
+    const int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    const bool ok = write(fd, "4", 1) == 1;
+    close(fd);
+    return ok;
+#else
+    return false;
+#endif // ifdef __linux__
+}
+
+// reads pagemap entries for n state pages starting at page i
+static bool pagemap_read(uint64_t *dst, size_t i, size_t n) {
+    const size_t len = n * sizeof(uint64_t);
+    const off_t off =
+        (((uintptr_t) state.base / state.page) + i) * sizeof(uint64_t);
+    return pread(state.pagemap_fd, dst, len, off) == (ssize_t) len;
+}
+
+// soft-dirty bit of /proc/self/pagemap entries
+#define PAGEMAP_SOFT_DIRTY (1ull << 55)
+
+// checks that writes to state are tracked through soft-dirty bits
+static bool soft_dirty_init() {
+#ifdef __linux__
+    state.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    if (state.pagemap_fd < 0 || !soft_dirty_clear()) {
+        return false;
+    }
 
-        struct timespec ts;
-        timespec_get(&ts, TIME_UTC);
+    // kernels without CONFIG_MEM_SOFT_DIRTY never set the bit
+    uint64_t entry;
+    *(volatile uint64_t*) &state.header->magic = STATE_MAGIC;
+    if (!pagemap_read(&entry, 0, 1) || !(entry & PAGEMAP_SOFT_DIRTY)) {
+        close(state.pagemap_fd);
+        state.pagemap_fd = -1;
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif // ifdef __linux__
+}
+
+// returns array of offsets of pages modified since the last checkpoint,
+// *n set to length. caller frees.
+static uint64_t *state_dirty_pages(size_t *n) {
+    // nothing is ever written above the bump allocator
+    const size_t npages = (state.header->top + state.page - 1) / state.page;
+    uint64_t *pages = malloc(npages * sizeof(uint64_t));
+    *n = 0;
+
+    if (!state.soft_dirty) {
+        for (size_t i = 0; i < npages; i++) {
+            pages[(*n)++] = i * state.page;
+        }
+        return pages;
+    }
+
+    uint64_t entries[4096];
+    for (size_t i = 0; i < npages; i += ARRLEN(entries)) {
+        const size_t count =
+            npages - i < ARRLEN(entries) ? npages - i : ARRLEN(entries);
+        assert(pagemap_read(entries, i, count));
 
-        // reload
-        if (op == RH_INIT
-            || (st.st_mtimespec.tv_sec > mod_time.tv_sec
-                && ts.tv_sec > st.st_mtimespec.tv_sec + 1)) {
-            if (module) {
-                assert(!dlclose(module));
-                module = NULL;
+        for (size_t j = 0; j < count; j++) {
+            if (entries[j] & PAGEMAP_SOFT_DIRTY) {
+                pages[(*n)++] = (i + j) * state.page;
             }
+        }
+    }
+
+    return pages;
+}
+
+// applies a complete journal left by an interrupted checkpoint, discards an
+// incomplete one
+static void state_replay_journal() {
+    const int fd = open(state.journal_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    journal_trailer_t trailer;
+    const size_t record = sizeof(uint64_t) + state.page;
+
+    if (fstat(fd, &st) == 0
+        && (size_t) st.st_size >= sizeof(trailer)
+        && pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer))
+            == sizeof(trailer)
+        && trailer.magic == STATE_MAGIC
+        && trailer.count * record + sizeof(trailer) == (size_t) st.st_size) {
+        char *page = malloc(state.page);
+        for (size_t i = 0; i < trailer.count; i++) {
+            uint64_t off;
+            assert(pread(fd, &off, sizeof(off), i * record) == sizeof(off));
+            assert(
+                pread(fd, page, state.page, i * record + sizeof(off))
+                    == (ssize_t) state.page);
+            assert(pwrite(state.fd, page, state.page, off)
+                    == (ssize_t) state.page);
+        }
+        free(page);
+        fsync(state.fd);
+        host_log(
+            false, "replayed %zu page(s) from %s\n",
+            (size_t) trailer.count, state.journal_path);
+    }
 
-            dlerror();
-            module = dlopen(argv[1], RTLD_LOCAL | RTLD_LAZY);
-            assert(module);
+    close(fd);
+    unlink(state.journal_path);
+}
 
-            func = (rh_entry_f) dlsym(module, STRINGIFY(RH_ENTRY_NAME));
-            assert(func);
-            mod_time = st.st_mtimespec;
+// serialize registry entries with storage inside persistent state as
+// (uint64_t offset, uint32_t module, char name[]) records so they can be
+// patched on restore
+static void state_save_funcs() {
+    const size_t record = sizeof(uint64_t) + sizeof(uint32_t);
 
-            if (op != RH_INIT) {
-                op = RH_RELOAD;
+    size_t len = 0;
+    for (size_t i = 0; i < modules.n; i++) {
+        map_each(void**, char*, &modules.list[i].funcs, it) {
+            if (state_contains(it.key)) {
+                len += record + strlen(it.value) + 1;
             }
         }
+    }
 
-        if (op == RH_RELOAD) {
-            // reload function pointers
-            map_each(void**, char*, &funcs, it) {
-                void *sym = dlsym(module, it.value);
-                assert(sym);
-                memcpy(it.key, &sym, sizeof(void*));
+    if (len > state.header->funcs_cap) {
+        const size_t cap = len * 2;
+        char *p = state_alloc(cap);
+        assert(p);
+        state.header->funcs = p - state.base;
+        state.header->funcs_cap = cap;
+    }
+
+    char *p = state.base + state.header->funcs;
+    for (uint32_t i = 0; i < modules.n; i++) {
+        map_each(void**, char*, &modules.list[i].funcs, it) {
+            if (state_contains(it.key)) {
+                const uint64_t off = (char*) it.key - state.base;
+                memcpy(p, &off, sizeof(off));
+                memcpy(p + sizeof(off), &i, sizeof(i));
+                p = stpcpy(p + record, it.value) + 1;
             }
         }
+    }
 
-        const int res = func(argc - 1, &argv[1], op, &rh);
-        if (res) {
-            if (res == RH_CLOSE_REQUESTED) {
-                printf("%s", "client requested close, exiting");
-                return func(argc - 1, &argv[1], RH_DEINIT, &rh);
-            } else {
-                printf("client exited with code %d", res);
-                return res;
+    state.header->funcs_len = len;
+}
+
+// see state_save_funcs, map is as set by state_match_modules
+static void state_load_funcs(const int *map) {
+    const char
+        *p = state.base + state.header->funcs,
+        *end = p + state.header->funcs_len;
+
+    while (p < end) {
+        uint64_t off;
+        uint32_t i;
+        memcpy(&off, p, sizeof(off));
+        memcpy(&i, p + sizeof(off), sizeof(i));
+        p += sizeof(off) + sizeof(i);
+        map_insert(&modules.list[map[i]].funcs, state.base + off, strdup(p));
+        p += strlen(p) + 1;
+    }
+}
+
+// sets map[j] to the index of the hosted module saved as module j in state,
+// matching them by name. exits if any is not hosted.
+static void state_match_modules(int *map) {
+    for (size_t j = 0; j < state.header->nmodules; j++) {
+        const char *name = state.base + state.header->names[j];
+
+        map[j] = -1;
+        for (size_t i = 0; i < modules.n; i++) {
+            if (!strcmp(modules.list[i].name, name)) {
+                map[j] = i;
             }
         }
 
-        op = RH_STEP;
+        if (map[j] < 0) {
+            fprintf(
+                stderr, "%s holds state for module %s, which is not hosted\n",
+                state.path, name);
+            exit(1);
+        }
+    }
+}
+
+// sets userdata and registry entries with storage in state of every module to
+// what was checkpointed
+static void state_restore_modules() {
+    int map[MAX_MODULES];
+    state_match_modules(map);
+    state_load_funcs(map);
+
+    // from here on, state is saved in hosted module order
+    uint64_t names[MAX_MODULES];
+    for (size_t j = 0; j < modules.n; j++) {
+        modules.list[map[j]].rh.userdata = state.header->userdata[j];
+        names[map[j]] = state.header->names[j];
+    }
+    memcpy(state.header->names, names, sizeof(names));
+}
+
+// writes state modified since the last checkpoint, host.lock must be held
+static void state_checkpoint() {
+    // a version on probation may have corrupted state, the checkpoint before
+    // its reload is the one to roll back to
+    if (!state.base || state.detached || guard.calls) {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    threads_stop();
+
+    for (size_t i = 0; i < modules.n; i++) {
+        state.header->userdata[i] = modules.list[i].rh.userdata;
+    }
+    state.header->ready = 1;
+    state_save_funcs();
+
+    size_t n;
+    uint64_t *pages = state_dirty_pages(&n);
+
+    // journal first so that a crash mid-checkpoint cannot leave the state
+    // file with a mix of old and new pages
+    const int fd =
+        open(state.journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+
+    for (size_t i = 0; i < n; i++) {
+        assert(write(fd, &pages[i], sizeof(pages[i])) == sizeof(pages[i]));
+        assert(
+            write(fd, state.base + pages[i], state.page)
+                == (ssize_t) state.page);
+    }
+
+    const journal_trailer_t trailer = { .magic = STATE_MAGIC, .count = n };
+    assert(write(fd, &trailer, sizeof(trailer)) == sizeof(trailer));
+    assert(!fsync(fd));
+    close(fd);
+
+    for (size_t i = 0; i < n; i++) {
+        assert(
+            pwrite(state.fd, state.base + pages[i], state.page, pages[i])
+                == (ssize_t) state.page);
+    }
+
+    assert(!fsync(state.fd));
+    unlink(state.journal_path);
+
+    if (state.soft_dirty) {
+        soft_dirty_clear();
+    }
+
+    free(pages);
+    threads_resume(false);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    state.last_checkpoint = end;
+    host_log(
+        false, "checkpoint: %zu page(s) in %.2f ms\n",
+        n, timespec_diff(end, start) * 1000.0);
+}
+
+// see reload_host::checkpoint
+static void client_checkpoint() {
+    // RH_RELOAD runs with the lock held and threads stopped, while the host
+    // checkpoints or reverts state anyway
+    if (host_locked) {
+        return;
+    }
+
+    host_lock();
+    host_drain();
+    state_checkpoint();
+    host_unlock();
+}
+
+// discards all modifications to state since the last checkpoint, returns
+// false if there is no state to revert
+static bool state_revert() {
+    if (!state.base || state.detached) {
+        return false;
     }
 
-    map_destroy(&funcs);
+    assert(
+        mmap(
+            state.base, state.size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, state.fd, 0) == state.base);
+
+    // fresh mappings report every page as soft-dirty
+    if (state.soft_dirty) {
+        soft_dirty_clear();
+    }
+
+    // registrations with storage in state are back to what was checkpointed
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+
+        size_t n = 0;
+        void **keys = malloc(map_size(&m->funcs) * sizeof(void*));
+        map_each(void**, char*, &m->funcs, it) {
+            if (state_contains(it.key)) {
+                keys[n++] = it.key;
+            }
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            map_remove(&m->funcs, keys[j]);
+        }
+
+        free(keys);
+    }
+
+    state_restore_modules();
+    return true;
+}
+
+// maps persistent state from path, creating it if it does not exist. returns
+// true if existing state was restored.
+static bool state_open(const char *path, size_t size) {
+    state.path = path;
+    state.page = sysconf(_SC_PAGESIZE);
+    assert(asprintf(&state.journal_path, "%s.journal", path) > 0);
+
+    state.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (state.fd < 0) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    state_replay_journal();
+
+    state_header_t header;
+    const bool restore =
+        pread(state.fd, &header, sizeof(header), 0) == sizeof(header)
+            && header.magic == STATE_MAGIC
+            && header.ready;
+
+    if (restore && header.nmodules != modules.n) {
+        fprintf(
+            stderr, "%s holds state for %d module(s), hosting %d\n",
+            path, (int) header.nmodules, (int) modules.n);
+        exit(1);
+    }
+
+    if (!restore) {
+        size = (size + state.page - 1) & ~(state.page - 1);
+        header = (state_header_t) {
+            .magic = STATE_MAGIC,
+            .size = size,
+            .base = STATE_ADDR,
+            .top = state.page,
+            .nmodules = modules.n,
+        };
+
+        assert(!ftruncate(state.fd, size));
+        assert(pwrite(state.fd, &header, sizeof(header), 0)
+                == sizeof(header));
+        assert(!fsync(state.fd));
+    }
+
+    // private mapping: modifications stay in memory until state_checkpoint
+    // writes them back, so the file always holds the last checkpoint
+    int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif // ifdef MAP_FIXED_NOREPLACE
+
+    void *base =
+        mmap(
+            (void*) (uintptr_t) header.base, header.size,
+            PROT_READ | PROT_WRITE, flags, state.fd, 0);
+
+    if (base != (void*) (uintptr_t) header.base) {
+        fprintf(
+            stderr, "could not map %s at %p\n",
+            path, (void*) (uintptr_t) header.base);
+        exit(1);
+    }
+
+    state.base = base;
+    state.size = header.size;
+    state.header = base;
+    state.soft_dirty = soft_dirty_init();
+    clock_gettime(CLOCK_MONOTONIC, &state.last_checkpoint);
+
+    for (size_t i = 0; i < modules.n; i++) {
+        modules.list[i].rh.alloc = state_alloc;
+    }
+
+    if (restore) {
+        state_restore_modules();
+    } else {
+        for (size_t i = 0; i < modules.n; i++) {
+            char *name = state_alloc(strlen(modules.list[i].name) + 1);
+            assert(name);
+            strcpy(name, modules.list[i].name);
+            state.header->names[i] = name - state.base;
+        }
+    }
+
+    host_log(
+        false, "%s state %s (%zu MiB, %s dirty tracking)\n",
+        restore ? "restored" : "created", path, state.size >> 20,
+        state.soft_dirty ? "soft-dirty" : "no");
+    return restore;
+}
+
+// private directory holding module copies, see module_copy. only its owner
+// can create or replace the files dlopen()ed from it.
+static struct {
+    char *dir;
+
+    // process which created dir, forked workers must not remove it
+    pid_t owner;
+} copies;
+
+static void copies_remove() {
+    if (copies.dir && getpid() == copies.owner) {
+        rmdir(copies.dir);
+    }
+}
+
+static bool copies_init() {
+    const char *tmp = getenv("TMPDIR");
+    char *dir;
+    assert(asprintf(&dir, "%s/reloadhost-XXXXXX", tmp ? tmp : "/tmp") > 0);
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+        free(dir);
+        return false;
+    }
+
+    copies.dir = dir;
+    copies.owner = getpid();
+    atexit(copies_remove);
+    return true;
+}
+
+// copies the module at path to a new file in copies.dir, as dlopen() would
+// otherwise return the already loaded handle for the same path while an old
+// version is still open. returns path of the copy, NULL on failure.
+static char *module_copy(const char *path) {
+    static int version = 0;
+
+    if (!copies.dir && !copies_init()) {
+        return NULL;
+    }
+
+    const char *name = strrchr(path, '/');
+    char *copy;
+    assert(
+        asprintf(
+            &copy, "%s/%d-%s", copies.dir, version++,
+            name ? name + 1 : path) > 0);
+
+    const int in = open(path, O_RDONLY),
+        out = open(copy, O_WRONLY | O_CREAT | O_EXCL, 0700);
+
+    bool ok = in >= 0 && out >= 0;
+    char buf[65536];
+    ssize_t n;
+    while (ok && (n = read(in, buf, sizeof(buf))) > 0) {
+        ok = write(out, buf, n) == n;
+    }
+
+    if (in >= 0) { close(in); }
+    if (out >= 0) { close(out); }
+
+    if (!ok) {
+        fprintf(stderr, "could not copy %s to %s\n", path, copy);
+        unlink(copy);
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+// opens a version of m from path, a copy made by module_copy. returns false on
+// failure.
+static bool module_load(
+    module_t *m, const char *path,
+    void **handle, void **base, rh_entry_f *func) {
+    dlerror();
+    *handle = dlopen(path, RTLD_LOCAL | RTLD_LAZY);
+    if (!*handle) {
+        fprintf(stderr, "could not load %s: %s\n", m->name, dlerror());
+        return false;
+    }
+
+    *func = (rh_entry_f) dlsym(*handle, STRINGIFY(RH_ENTRY_NAME));
+
+    Dl_info info;
+    if (!*func || !dladdr(*func, &info)) {
+        fprintf(
+            stderr, "%s has no %s\n", m->name, STRINGIFY(RH_ENTRY_NAME));
+        dlclose(*handle);
+        return false;
+    }
+
+    *base = info.dli_fbase;
+    return true;
+}
+
+// opens the current version of m's file, see module_load
+static bool module_load_copy(
+    module_t *m, void **handle, void **base, rh_entry_f *func) {
+    char *copy = module_copy(m->path);
+    if (!copy) {
+        return false;
+    }
+
+    const bool ok = module_load(m, copy, handle, base, func);
+    unlink(copy);
+    free(copy);
+    return ok;
+}
+
+// points every function pointer in m's registry at its symbol in handle. if
+// strict, returns false on the first symbol handle does not have, otherwise
+// sets such pointers to NULL.
+static bool module_patch(module_t *m, void *handle, bool strict) {
+    map_each(void**, char*, &m->funcs, it) {
+        void *sym = dlsym(handle, it.value);
+        if (!sym && strict) {
+            host_log(
+                true, "new version of %s is missing %s\n", m->name, it.value);
+            return false;
+        }
+
+        memcpy(it.key, &sym, sizeof(void*));
+    }
+
+    return true;
+}
+
+static void guard_handler(int sig) {
+    if (!guard_active) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+
+    guard.sig = sig;
+    siglongjmp(guard.env, 1);
+}
+
+// signals that a guarded call recovers from
+static const int GUARD_SIGNALS[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+static void guard_init() {
+    // handler must not run on the stack that overflowed
+    stack_t ss = {
+        .ss_sp = malloc(SIGSTKSZ * 4),
+        .ss_size = SIGSTKSZ * 4,
+    };
+    assert(!sigaltstack(&ss, NULL));
+
+    struct sigaction sa = {
+        .sa_handler = guard_handler,
+        .sa_flags = SA_ONSTACK | SA_NODEFER,
+    };
+    sigemptyset(&sa.sa_mask);
+
+    for (size_t i = 0; i < ARRLEN(GUARD_SIGNALS); i++) {
+        assert(!sigaction(GUARD_SIGNALS[i], &sa, NULL));
+    }
+}
+
+// calls m, returns false if it faulted
+static bool guarded_call(module_t *m, reload_host_op op, int *res) {
+    if (sigsetjmp(guard.env, 1)) {
+        guard_active = 0;
+        return false;
+    }
+
+    guard_active = 1;
+    *res = m->func(m->argc, m->argv, op, &m->rh);
+    guard_active = 0;
+    return true;
+}
+
+static void thread_pin(int cpu, const char *name) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        fprintf(
+            stderr, "could not pin %s thread to cpu %d: %s\n",
+            name, cpu, strerror(err));
+    }
+#else
+    fprintf(
+        stderr, "could not pin %s thread to cpu %d: unsupported\n", name, cpu);
+#endif // ifdef __linux__
+}
+
+// CLOCK_MONOTONIC time of CLOCK_REALTIME time t, which is in the past
+static struct timespec timespec_monotonic(struct timespec t) {
+    struct timespec real, mono;
+    timespec_get(&real, TIME_UTC);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    long long ns =
+        (real.tv_sec - t.tv_sec) * 1000000000ll + (real.tv_nsec - t.tv_nsec);
+    ns = ns < 0 ? 0 : ns;
+
+    mono.tv_sec -= ns / 1000000000;
+    mono.tv_nsec -= ns % 1000000000;
+    if (mono.tv_nsec < 0) {
+        mono.tv_sec--;
+        mono.tv_nsec += 1000000000;
+    }
+
+    return mono;
+}
+
+static const char *BUILD_SOURCE_NAMES[] = {
+    "Makefile", "makefile", "GNUmakefile", "CMakeLists.txt"
+};
+
+static const char *BUILD_SOURCE_EXTS[] = {
+    ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx", ".inl", ".m",
+    ".mm", ".s", ".S", ".cmake", ".mk"
+};
+
+// true if name looks like something a build depends on. everything else is
+// ignored so that build output does not trigger another build.
+static bool build_is_source(const char *name) {
+    for (size_t i = 0; i < ARRLEN(BUILD_SOURCE_NAMES); i++) {
+        if (!strcmp(name, BUILD_SOURCE_NAMES[i])) {
+            return true;
+        }
+    }
+
+    const char *ext = strrchr(name, '.');
+    for (size_t i = 0; ext && i < ARRLEN(BUILD_SOURCE_EXTS); i++) {
+        if (!strcmp(ext, BUILD_SOURCE_EXTS[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// adds sources under path to newest and count. hidden entries, symlinked
+// directories and cmake build trees (which the build itself writes to) below
+// path are skipped.
+static void build_scan_dir(
+    const char *path, bool top, struct timespec *newest, size_t *count) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+
+    if (!top && !faccessat(dirfd(dir), "CMakeCache.txt", F_OK, 0)) {
+        closedir(dir);
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+
+        char p[PATH_MAX];
+        if (snprintf(p, sizeof(p), "%s/%s", path, e->d_name)
+                >= (int) sizeof(p)) {
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(p, &st) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            build_scan_dir(p, false, newest, count);
+            continue;
+        }
+
+        if (!build_is_source(e->d_name)
+            || stat(p, &st) < 0
+            || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        (*count)++;
+        if (timespec_diff(STAT_MTIME(st), *newest) > 0) {
+            *newest = STAT_MTIME(st);
+        }
+    }
+
+    closedir(dir);
+}
+
+// true if sources changed since the last scan
+static bool build_scan() {
+    struct timespec newest = { 0 };
+    size_t count = 0;
+    for (int i = 0; i < opts.nbuild_dirs; i++) {
+        build_scan_dir(opts.build_dirs[i], true, &newest, &count);
+    }
+
+    if (count == build.count
+        && !timespec_diff(newest, build.newest)) {
+        return false;
+    }
+
+    // a source was removed if nothing got newer
+    clock_gettime(CLOCK_MONOTONIC, &build.edited);
+    if (timespec_diff(newest, build.newest) > 0) {
+        build.edited = timespec_monotonic(newest);
+    }
+
+    build.newest = newest;
+    build.count = count;
+    return true;
+}
+
+// sources are compared against what they were when the host started
+static void build_init() {
+    if (!opts.nbuild_dirs) {
+        opts.build_dirs[opts.nbuild_dirs++] = ".";
+    }
+
+    build_scan();
+}
+
+static void build_start(struct timespec now) {
+    build.dirty = false;
+
+    // the supervisor ignores SIGPIPE, the build should not
+    sigset_t sigdefault;
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+
+    // own process group so that the whole build can be cancelled
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(
+        &attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+    char *argv[] = { "/bin/sh", "-c", (char*) opts.build_cmd, NULL };
+
+    fflush(stdout);
+    fflush(stderr);
+    const int err =
+        posix_spawn(&build.pid, "/bin/sh", NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+
+    if (err) {
+        build.pid = 0;
+        fprintf(stderr, "could not run build: %s\n", strerror(err));
+        return;
+    }
+
+    build.current = (build_cycle_t) {
+        .cycle = build.current.cycle + 1,
+        .edited = build.edited,
+        .started = now
+    };
+}
+
+// kills the running build, if any
+static void build_cancel() {
+    if (build.pid > 0) {
+        killpg(build.pid, SIGTERM);
+        waitpid(build.pid, NULL, 0);
+        build.pid = 0;
+    }
+}
+
+// build.pid exited with status
+static void build_finish(int status) {
+    build.pid = 0;
+    clock_gettime(CLOCK_MONOTONIC, &build.current.finished);
+
+    const double ms =
+        timespec_diff(build.current.finished, build.current.started) * 1000.0;
+    if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+        printf("cycle %u: build finished in %.2f ms\n", build.current.cycle, ms);
+        build.done = build.current;
+        build.check = true;
+    } else {
+        fprintf(
+            stderr, "cycle %u: build failed with code %d after %.2f ms\n",
+            build.current.cycle,
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+            ms);
+    }
+
+    fflush(stdout);
+}
+
+// runs opts.build_cmd once sources under opts.build_dirs have settled after a
+// change, cancelling any build already running for older sources. sets
+// build.check when a build succeeds.
+static void build_poll() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int status;
+    if (build.pid > 0 && waitpid(build.pid, &status, WNOHANG) == build.pid) {
+        build_finish(status);
+    }
+
+    if (timespec_diff(now, build.scanned) * 1e9 >= BUILD_SCAN_NS) {
+        build.scanned = now;
+
+        if (build_scan()) {
+            build.dirty = true;
+            build.changed = now;
+
+            if (build.pid > 0) {
+                printf(
+                    "cycle %u: sources changed, cancelling build\n",
+                    build.current.cycle);
+                fflush(stdout);
+                build_cancel();
+            }
+        }
+    }
+
+    if (build.dirty
+        && build.pid <= 0
+        && timespec_diff(now, build.changed) * 1e9 >= BUILD_DEBOUNCE_NS) {
+        build_start(now);
+    }
+}
+
+// true if m's file has changed and was not written to for a second, or has
+// changed at all if built (a build that wrote it has exited)
+static bool host_module_changed(module_t *m, bool built) {
+    struct stat st;
+    if (stat(m->path, &st) < 0) {
+        return false;
+    }
+
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    if (timespec_diff(STAT_MTIME(st), m->mod_time) > 0
+        && (built || ts.tv_sec > STAT_MTIME(st).tv_sec + 1)) {
+        m->mod_time = STAT_MTIME(st);
+        return true;
+    }
+
+    return false;
+}
+
+// reads the next command from the supervisor into cmd, returns false if it has
+// not arrived in full yet
+static bool worker_read(worker_cmd_t *cmd) {
+    while (worker.cmd_len < sizeof(*cmd)) {
+        const ssize_t n =
+            read(
+                worker.cmd_fd, (char*) &worker.cmd + worker.cmd_len,
+                sizeof(*cmd) - worker.cmd_len);
+        if (n <= 0) {
+            return false;
+        }
+
+        worker.cmd_len += n;
+    }
+
+    *cmd = worker.cmd;
+    worker.cmd_len = 0;
+    return true;
+}
+
+static void *host_main(void *arg) {
+    (void) arg;
+
+    if (opts.host_cpu >= 0) {
+        thread_pin(opts.host_cpu, "host");
+    }
+
+    while (!atomic_load_explicit(&host.quit, memory_order_relaxed)) {
+        if (opts.build_cmd && worker.index < 0) {
+            build_poll();
+        }
+
+        host_lock();
+        host_drain();
+        modules_unload();
+
+        // nothing new is published until the step thread has taken the last
+        // request and any reload is over
+        const bool idle =
+            !host.reloading
+                && !atomic_load_explicit(&host.pending, memory_order_relaxed);
+
+        int pending = 0;
+        if (idle
+            && state.base
+            && !state.detached
+            && opts.checkpoint_interval > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timespec_diff(now, state.last_checkpoint)
+                    >= opts.checkpoint_interval) {
+                pending |= PENDING_CHECKPOINT;
+            }
+        }
+        host_unlock();
+
+        // workers load what the supervisor tells them to, one version at a
+        // time and only as a whole
+        worker_cmd_t cmd;
+        while (idle
+               && worker.index >= 0
+               && !(pending & PENDING_RELOAD)
+               && worker_read(&cmd)) {
+            if (cmd.module >= modules.n) {
+                fprintf(stderr, "bad command for module %u\n", cmd.module);
+                worker.failed = true;
+            } else if (!worker.failed) {
+                module_t *m = &modules.list[cmd.module];
+                if (m->next_handle) {
+                    dlclose(m->next_handle);
+                }
+
+                cmd.path[sizeof(cmd.path) - 1] = '\0';
+                if (!module_load(
+                        m, cmd.path, &m->next_handle, &m->next_base,
+                        &m->next_func)) {
+                    m->next_handle = NULL;
+                    worker.failed = true;
+                }
+            }
+
+            if (!cmd.last) {
+                continue;
+            }
+
+            if (!worker.failed) {
+                worker.version = cmd.version;
+                pending |= PENDING_RELOAD;
+                continue;
+            }
+
+            for (size_t i = 0; i < modules.n; i++) {
+                module_t *m = &modules.list[i];
+                if (m->next_handle) {
+                    dlclose(m->next_handle);
+                    m->next_handle = NULL;
+                }
+            }
+
+            worker.failed = false;
+
+            worker_report_t report = {
+                .worker = worker.index,
+                .version = cmd.version,
+            };
+            clock_gettime(CLOCK_MONOTONIC, &report.applied);
+            assert(
+                write(worker.report_fd, &report, sizeof(report))
+                    == sizeof(report));
+        }
+
+        // with -b modules are checked as soon as a build succeeds, and not
+        // while one is running
+        const bool built = idle && build.check;
+        build.check = build.check && !built;
+
+        // loaded without the lock held, the step thread may need it. next_*
+        // are not read by the step thread until published through pending.
+        size_t changed = 0;
+        for (size_t i = 0;
+             idle && worker.index < 0 && (built || build.pid <= 0)
+                && i < modules.n;
+             i++) {
+            module_t *m = &modules.list[i];
+            if (!host_module_changed(m, built)) {
+                continue;
+            }
+
+            changed++;
+
+            if (module_load_copy(
+                    m, &m->next_handle, &m->next_base, &m->next_func)) {
+                pending |= PENDING_RELOAD;
+            } else {
+                m->next_handle = NULL;
+                fprintf(
+                    stderr, "new version of %s failed to load, ignoring\n",
+                    m->name);
+            }
+        }
+
+        if (built && !changed) {
+            printf("cycle %u: no module changed\n", build.done.cycle);
+            fflush(stdout);
+        }
+
+        if (pending) {
+            host_lock();
+            if (pending & PENDING_RELOAD) {
+                host.reloading = true;
+                build.applying = built ? build.done : (build_cycle_t) { 0 };
+            }
+            atomic_fetch_or_explicit(
+                &host.pending, pending, memory_order_release);
+            host_unlock();
+        }
+
+        nanosleep(
+            &(struct timespec) { .tv_sec = 0, .tv_nsec = HOST_INTERVAL_NS },
+            NULL);
+    }
+
+    return NULL;
+}
+
+static void host_start() {
+    host.running = true;
+    assert(!pthread_create(&host.thread, NULL, host_main, NULL));
+}
+
+// stops host thread and flushes its queue
+static void host_stop() {
+    if (host.running) {
+        atomic_store(&host.quit, true);
+        pthread_join(host.thread, NULL);
+        host.running = false;
+    }
+
+    build_cancel();
+
+    host_lock();
+    host_drain();
+    host_unlock();
+    fflush(stdout);
+}
+
+static int module_find(const char *name) {
+    for (size_t i = 0; i < modules.n; i++) {
+        if (!strcmp(modules.list[i].name, name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// adds module at path, passing it argv
+static module_t *module_add(
+    const char *name, const char *path, int argc, char *argv[]) {
+    if (modules.n == MAX_MODULES) {
+        fprintf(stderr, "too many modules, at most %d\n", MAX_MODULES);
+        exit(1);
+    } else if (module_find(name) >= 0) {
+        fprintf(stderr, "module %s is listed twice\n", name);
+        exit(1);
+    }
+
+    module_t *m = &modules.list[modules.n++];
+    *m = (module_t) {
+        .name = strdup(name),
+        .path = strdup(path),
+        .argc = argc + 1,
+        .argv = calloc(argc + 2, sizeof(char*)),
+    };
+
+    m->argv[0] = m->path;
+    memcpy(&m->argv[1], argv, argc * sizeof(char*));
+
+    m->rh = (reload_host_t) {
+        .reg_fn = reg_fn,
+        .del_fn = del_fn,
+        .userdata = NULL,
+        .alloc = NULL,
+        .checkpoint = client_checkpoint,
+        .thread_register = thread_register,
+        .thread_unregister = thread_unregister,
+        .safe_point = safe_point,
+        .worker = -1
+    };
+
+    map_init(
+        &m->funcs,
+        map_hash_id,
+        NULL,
+        NULL,
+        NULL,
+        map_cmp_id,
+        NULL,
+        map_default_free,
+        NULL);
+
+    return m;
+}
+
+// reads manifest of "name path [dependency...]" lines, every module passed
+// argv. dependencies must be listed before the modules depending on them.
+static void modules_read_manifest(const char *path, int argc, char *argv[]) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        char *save;
+        const char
+            *name = strtok_r(line, " \t\r\n", &save),
+            *mpath = name ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+        if (!name) {
+            continue;
+        } else if (!mpath) {
+            fprintf(stderr, "%s: module %s has no path\n", path, name);
+            exit(1);
+        }
+
+        module_t *m = module_add(name, mpath, argc, argv);
+
+        const char *dep;
+        while ((dep = strtok_r(NULL, " \t\r\n", &save))) {
+            const int i = module_find(dep);
+            if (i < 0 || &modules.list[i] == m) {
+                fprintf(
+                    stderr, "%s: %s depends on %s, which is not listed before it\n",
+                    path, name, dep);
+                exit(1);
+            }
+
+            // distinct modules listed before m, so deps cannot overflow
+            for (size_t j = 0; j < m->ndeps; j++) {
+                if (m->deps[j] == i) {
+                    fprintf(
+                        stderr, "%s: %s depends on %s more than once\n",
+                        path, name, dep);
+                    exit(1);
+                }
+            }
+
+            m->deps[m->ndeps++] = i;
+        }
+    }
+
+    fclose(f);
+
+    if (!modules.n) {
+        fprintf(stderr, "%s: no modules\n", path);
+        exit(1);
+    }
+}
+
+// steps every module in dependency order, under fault guard while new
+// versions are on probation. returns false if a guarded step failed.
+static bool modules_step(int *res) {
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        if (!guard.calls) {
+            *res = m->func(m->argc, m->argv, RH_STEP, &m->rh);
+        } else if (!guarded_call(m, RH_STEP, res)
+                   || (*res && *res != RH_CLOSE_REQUESTED)) {
+            return false;
+        }
+
+        if (*res) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+// takes the versions published by the host thread, marking their modules and
+// everything depending on them as reloading
+static void modules_swap() {
+    char names[1024] = "";
+    size_t len = 0;
+
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        m->reloading = m->next_handle != NULL;
+        for (size_t j = 0; j < m->ndeps; j++) {
+            m->reloading |= modules.list[m->deps[j]].reloading;
+        }
+
+        if (!m->reloading) {
+            continue;
+        }
+
+        m->prev_userdata = m->rh.userdata;
+        if (m->next_handle) {
+            m->prev_handle = m->handle;
+            m->prev_base = m->base;
+            m->prev_func = m->func;
+            m->handle = m->next_handle;
+            m->base = m->next_base;
+            m->func = m->next_func;
+            m->next_handle = NULL;
+        }
+
+        len += snprintf(
+            names + len, sizeof(names) - len,
+            "%s%s%s", len ? ", " : "", m->name,
+            m->prev_handle ? "" : " (dependency changed)");
+        len = len < sizeof(names) - 1 ? len : sizeof(names) - 1;
+    }
+
+    host_log(false, "reloading %s\n", names);
+}
+
+// patches the registries of changed modules and sends RH_RELOAD to every
+// reloading module in dependency order, returns false on failure
+static bool modules_reload(int *res) {
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        if (!m->reloading) {
+            continue;
+        }
+
+        if ((m->prev_handle && !module_patch(m, m->handle, true))
+            || !guarded_call(m, RH_RELOAD, res)
+            || (*res && *res != RH_CLOSE_REQUESTED)) {
+            return false;
+        }
+
+        if (*res) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+// puts every reloading module back on its last known good version and sends
+// it RH_RELOAD, returns false if that fails too. the failed versions are left
+// in prev_handle for modules_commit() to retire once threads have resumed.
+static bool modules_rollback(int *res) {
+    // registrations made by the new versions
+    host_drain();
+    const bool reverted = state_revert();
+
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        if (!m->reloading) {
+            continue;
+        }
+
+        if (!reverted) {
+            m->rh.userdata = m->prev_userdata;
+        }
+
+        if (m->prev_handle) {
+            module_patch(m, m->prev_handle, false);
+
+            void *handle = m->handle, *base = m->base;
+            m->handle = m->prev_handle;
+            m->base = m->prev_base;
+            m->func = m->prev_func;
+            m->prev_handle = handle;
+            m->prev_base = base;
+        }
+    }
+
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        if (m->reloading) {
+            if (!guarded_call(m, RH_RELOAD, res) || *res) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// new versions made it through their guard period (or were rolled back),
+// retire the versions they replaced. threads must have resumed since.
+static void modules_commit() {
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+        if (m->prev_handle) {
+            module_retire(m->prev_handle);
+            m->prev_handle = NULL;
+            m->prev_base = NULL;
+        }
+
+        m->reloading = false;
+    }
+}
+
+// sends a report for the version last published by the host thread to the
+// supervisor if this is a worker, or to the host thread for build timings
+// with -b
+static void worker_report(bool ok, struct timespec applied, double recovery_ms) {
+    if (worker.index < 0 && !opts.build_cmd) {
+        return;
+    }
+
+    queue_push(&(msg_t) {
+        .type = MSG_REPORT,
+        .report = {
+            .worker = worker.index,
+            .version = worker.version,
+            .ok = ok,
+            .applied = applied,
+            .recovery_ms = recovery_ms
+        }
+    });
+}
+
+// worker reports for one command version, see supervise
+typedef struct {
+    uint32_t version;
+    struct timespec sent, first, last;
+    int reports, ok;
+
+    // workers which reported on this version or a later one. workers only
+    // read commands between reloads, and apply every command read at once.
+    bool reported[MAX_WORKERS];
+
+    // copies of modules sent with this version, removed once every live
+    // worker has reported on it
+    char *copies[MAX_MODULES];
+    size_t ncopies;
+
+    // build cycle that produced this version, if any
+    build_cycle_t build;
+} round_t;
+
+// versions not yet reported on by every live worker, oldest first
+static struct {
+    round_t *list;
+    size_t n, cap;
+} rounds;
+
+static round_t *round_add(uint32_t version) {
+    if (rounds.n == rounds.cap) {
+        rounds.cap = rounds.cap ? rounds.cap * 2 : 4;
+        rounds.list = realloc(rounds.list, rounds.cap * sizeof(round_t));
+    }
+
+    round_t *r = &rounds.list[rounds.n++];
+    *r = (round_t) { .version = version };
+    return r;
+}
+
+static void round_finish(round_t *r, int live) {
+    if (r->reports) {
+        printf(
+            "version %u: running on %d/%d worker(s), applied %.2f to %.2f ms "
+            "after command (skew %.2f ms)\n",
+            r->version, r->ok, live,
+            timespec_diff(r->first, r->sent) * 1000.0,
+            timespec_diff(r->last, r->sent) * 1000.0,
+            timespec_diff(r->last, r->first) * 1000.0);
+        fflush(stdout);
+
+        if (r->build.cycle) {
+            build_cycle_report(&r->build, r->ok > 0, r->last);
+        }
+    }
+
+    for (size_t i = 0; i < r->ncopies; i++) {
+        unlink(r->copies[i]);
+        free(r->copies[i]);
+    }
+}
+
+// finishes the oldest versions every live worker has reported on, or all of
+// them once no worker is left. a report covers earlier versions too, so they
+// complete in order.
+static void rounds_update(const pid_t *pids, int n, int live) {
+    size_t done = 0;
+    for (; done < rounds.n; done++) {
+        round_t *r = &rounds.list[done];
+
+        bool complete = true;
+        for (int i = 0; complete && i < n; i++) {
+            complete = !pids[i] || r->reported[i];
+        }
+
+        if (!complete) {
+            break;
+        }
+
+        round_finish(r, live);
+    }
+
+    rounds.n -= done;
+    memmove(rounds.list, rounds.list + done, rounds.n * sizeof(round_t));
+}
+
+// writes all n bytes of p to fd, which may take several writes for more than
+// PIPE_BUF bytes
+static bool write_all(int fd, const void *p, size_t n) {
+    while (n > 0) {
+        const ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            return false;
+        }
+
+        p = (const char*) p + w;
+        n -= w;
+    }
+
+    return true;
+}
+
+// watches modules for the workers: a changed module is copied once and the
+// copy sent to every worker at the same time, and their reports gathered.
+// returns once all workers have exited, with the first non-zero exit code.
+static int supervise(pid_t *pids, int *cmd_fds, int report_fd, int n) {
+    // a worker may exit while a command is being written to it
+    signal(SIGPIPE, SIG_IGN);
+
+    int live = n, code = 0;
+    uint32_t version = 0;
+
+    while (live > 0) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (pid == build.pid) {
+                build_finish(status);
+                continue;
+            }
+
+            for (int i = 0; i < n; i++) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+
+                const int c =
+                    WIFEXITED(status) ?
+                        WEXITSTATUS(status)
+                        : 128 + WTERMSIG(status);
+                if (c) {
+                    fprintf(stderr, "worker %d exited with code %d\n", i, c);
+                }
+
+                code = code ? code : c;
+                close(cmd_fds[i]);
+                cmd_fds[i] = -1;
+                pids[i] = 0;
+                live--;
+            }
+
+            rounds_update(pids, n, live);
+        }
+
+        if (opts.build_cmd) {
+            build_poll();
+        }
+
+        // every module changed since the last check goes out as one version,
+        // see host_main for -b
+        const bool built = build.check;
+        build.check = false;
+
+        worker_cmd_t cmds[MAX_MODULES];
+        size_t ncmds = 0;
+        round_t *round = NULL;
+        for (size_t i = 0;
+             live > 0 && (built || build.pid <= 0) && i < modules.n;
+             i++) {
+            module_t *m = &modules.list[i];
+            if (!host_module_changed(m, built)) {
+                continue;
+            }
+
+            char *copy = module_copy(m->path);
+            if (!copy) {
+                continue;
+            } else if (strlen(copy) >= sizeof(cmds[0].path)) {
+                fprintf(stderr, "path too long: %s\n", copy);
+                unlink(copy);
+                free(copy);
+                continue;
+            }
+
+            if (!ncmds) {
+                round = round_add(++version);
+            }
+
+            round->copies[round->ncopies++] = copy;
+            cmds[ncmds] = (worker_cmd_t) {
+                .version = version,
+                .module = i
+            };
+            strcpy(cmds[ncmds].path, copy);
+            ncmds++;
+        }
+
+        if (built && !ncmds) {
+            printf("cycle %u: no module changed\n", build.done.cycle);
+            fflush(stdout);
+        }
+
+        if (ncmds) {
+            cmds[ncmds - 1].last = true;
+            round->build = built ? build.done : (build_cycle_t) { 0 };
+            clock_gettime(CLOCK_MONOTONIC, &round->sent);
+            for (int i = 0; i < n; i++) {
+                if (cmd_fds[i] >= 0
+                    && !write_all(cmd_fds[i], cmds, ncmds * sizeof(cmds[0]))) {
+                    fprintf(
+                        stderr, "could not send version %u to worker %d\n",
+                        version, i);
+                }
+            }
+        }
+
+        struct pollfd pfd = { .fd = report_fd, .events = POLLIN };
+        if (poll(&pfd, 1, HOST_INTERVAL_NS / 1000000) <= 0) {
+            continue;
+        }
+
+        worker_report_t r;
+        while (read(report_fd, &r, sizeof(r)) == sizeof(r)) {
+            if (!r.ok) {
+                fprintf(
+                    stderr, "worker %d rejected version %u (%.2f ms)\n",
+                    r.worker, r.version, r.recovery_ms);
+            }
+
+            for (size_t i = 0; i < rounds.n; i++) {
+                round_t *round = &rounds.list[i];
+                if (round->version > r.version || round->reported[r.worker]) {
+                    continue;
+                }
+
+                if (!round->reports
+                    || timespec_diff(r.applied, round->first) < 0) {
+                    round->first = r.applied;
+                }
+
+                if (!round->reports
+                    || timespec_diff(r.applied, round->last) > 0) {
+                    round->last = r.applied;
+                }
+
+                round->reported[r.worker] = true;
+                round->reports++;
+                round->ok += r.ok;
+            }
+        }
+
+        rounds_update(pids, n, live);
+    }
+
+    build_cancel();
+    rounds_update(pids, n, live);
+    return code;
+}
+
+// forks opts.workers workers sharing everything up to here copy-on-write.
+// returns -1 in workers, which go on as regular hosts taking reloads from the
+// supervisor, and the exit code of the workers in the supervisor.
+static int workers_fork() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // nothing buffered may be written by every process
+    host_drain();
+    fflush(stdout);
+    fflush(stderr);
+
+    int report[2];
+    assert(!pipe(report));
+
+    pid_t pids[MAX_WORKERS];
+    int cmd_fds[MAX_WORKERS];
+
+    for (int i = 0; i < opts.workers; i++) {
+        int cmd[2];
+        assert(!pipe(cmd));
+
+        const pid_t pid = fork();
+        assert(pid >= 0);
+
+        if (pid == 0) {
+            for (int j = 0; j < i; j++) {
+                close(cmd_fds[j]);
+            }
+
+            close(cmd[1]);
+            close(report[0]);
+            fcntl(cmd[0], F_SETFL, O_NONBLOCK);
+
+            worker.index = i;
+            worker.cmd_fd = cmd[0];
+            worker.report_fd = report[1];
+            state.detached = true;
+
+            // client threads are not forked along, nor are their
+            // registrations
+            threads.lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+            threads.registered = 0;
+            threads.parked = 0;
+            for (int j = 0; j < MAX_THREADS; j++) {
+                atomic_store(&threads.slots[j].epoch, EPOCH_UNUSED);
+            }
+
+            for (size_t j = 0; j < modules.n; j++) {
+                modules.list[j].rh.worker = i;
+            }
+
+            if (opts.step_cpu >= 0) {
+                thread_pin(opts.step_cpu + i, "step");
+            }
+
+            return -1;
+        }
+
+        close(cmd[0]);
+        pids[i] = pid;
+        cmd_fds[i] = cmd[1];
+    }
+
+    close(report[1]);
+    fcntl(report[0], F_SETFL, O_NONBLOCK);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf(
+        "forked %d worker(s) in %.2f ms\n",
+        opts.workers, timespec_diff(end, start) * 1000.0);
+    fflush(stdout);
+
+    return supervise(pids, cmd_fds, report[0], opts.workers);
+}
+
+int main(int argc, char *argv[]) {
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        const char *arg = argv[argi];
+        if (argi + 1 >= argc || arg[1] == '\0' || arg[2] != '\0') {
+            argi = argc;
+            break;
+        }
+
+        switch (arg[1]) {
+        case 'm': opts.manifest_path = argv[++argi]; break;
+        case 's': opts.state_path = argv[++argi]; break;
+        case 'S': opts.state_size = strtoull(argv[++argi], NULL, 10) << 20; break;
+        case 'c': opts.checkpoint_interval = strtod(argv[++argi], NULL); break;
+        case 'g': opts.guard_steps = atoi(argv[++argi]); break;
+        case 'G': opts.unload_grace = strtod(argv[++argi], NULL); break;
+        case 'H': opts.host_cpu = atoi(argv[++argi]); break;
+        case 'T': opts.step_cpu = atoi(argv[++argi]); break;
+        case 'w': opts.workers = atoi(argv[++argi]); break;
+        case 'b': opts.build_cmd = argv[++argi]; break;
+        case 'd':
+            if (opts.nbuild_dirs == MAX_BUILD_DIRS) {
+                argi = argc + 1;
+                break;
+            }
+
+            opts.build_dirs[opts.nbuild_dirs++] = argv[++argi];
+            break;
+        default: argi = argc + 1; break;
+        }
+    }
+
+    if (argi > argc
+        || (!opts.manifest_path && argi == argc)
+        || opts.guard_steps < 0
+        || opts.workers < 0
+        || opts.workers > MAX_WORKERS) {
+        printf("%s", USAGE);
+        return 1;
+    }
+
+    // module args follow options (and module path)
+    if (opts.manifest_path) {
+        modules_read_manifest(opts.manifest_path, argc - argi, &argv[argi]);
+    } else {
+        const char *name = strrchr(argv[argi], '/');
+        module_add(
+            name ? name + 1 : argv[argi], argv[argi],
+            argc - argi - 1, &argv[argi + 1]);
+    }
+
+    step_thread = pthread_self();
+    for (int i = 0; i < MAX_THREADS; i++) {
+        atomic_init(&threads.slots[i].epoch, EPOCH_UNUSED);
+    }
+
+    if (opts.step_cpu >= 0) {
+        thread_pin(opts.step_cpu, "step");
+    }
+
+    guard_init();
+
+    reload_host_op op = RH_INIT;
+    if (opts.state_path && state_open(opts.state_path, opts.state_size)) {
+        op = RH_RESTORE;
+    }
+
+    for (size_t i = 0; i < modules.n; i++) {
+        module_t *m = &modules.list[i];
+
+        struct stat st;
+        if (stat(m->path, &st) < 0
+            || !module_load_copy(m, &m->handle, &m->base, &m->func)) {
+            fprintf(stderr, "could not load %s (%s)\n", m->name, m->path);
+            return 1;
+        }
+
+        m->mod_time = STAT_MTIME(st);
+
+        if (op == RH_RESTORE) {
+            module_patch(m, m->handle, false);
+        }
+    }
+
+    if (opts.build_cmd) {
+        build_init();
+    }
+
+    // host thread is not running yet, no need to lock
+    host_drain();
+
+    // number of modules to send RH_DEINIT
+    size_t ninit = 0;
+
+    int res = 0;
+    for (; ninit < modules.n && !res; ninit++) {
+        module_t *m = &modules.list[ninit];
+        res = m->func(m->argc, m->argv, op, &m->rh);
+    }
+
+    if (op == RH_INIT && !res) {
+        client_checkpoint();
+    }
+
+    // startup is paid once, by the supervisor
+    if (opts.workers > 0 && !res) {
+        const int code = workers_fork();
+        if (code >= 0) {
+            return code;
+        }
+    }
+
+    host_start();
+
+    // when the last reload started running, see worker_report
+    struct timespec applied;
+
+    while (!res) {
+        bool reload = false;
+
+        // the only cost of host services on the step path
+        const int pending =
+            atomic_load_explicit(&host.pending, memory_order_relaxed);
+        if (pending) {
+            host_lock();
+            atomic_exchange_explicit(&host.pending, 0, memory_order_acquire);
+            host_drain();
+
+            if (pending & PENDING_RELOAD) {
+                // last state produced by the old versions, rolled back to if
+                // the new ones turn out to be broken
+                state_checkpoint();
+                modules_swap();
+                guard.calls = opts.guard_steps + 1;
+                reload = true;
+            } else if (pending & PENDING_CHECKPOINT) {
+                state_checkpoint();
+            }
+
+            host_unlock();
+        }
+
+        if (!guard.calls) {
+            modules_step(&res);
+            continue;
+        }
+
+        // registries are patched and RH_RELOAD runs with client threads
+        // parked, they pick up the new versions when they resume
+        if (reload) {
+            host_lock();
+            threads_stop();
+        }
+
+        // new versions run RH_RELOAD and their first steps under guard,
+        // rolling back to the previous versions if they crash or fail
+        guard.sig = 0;
+        const bool ok = reload ? modules_reload(&res) : modules_step(&res);
+
+        if (!ok) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            char why[128];
+            if (guard.sig) {
+                snprintf(
+                    why, sizeof(why), "new version crashed (%s)",
+                    strsignal(guard.sig));
+            } else if (res) {
+                snprintf(
+                    why, sizeof(why), "new version failed with code %d", res);
+            } else {
+                snprintf(why, sizeof(why), "new version failed to reload");
+            }
+
+            if (!reload) {
+                host_lock();
+                threads_stop();
+            }
+
+            guard.calls = 0;
+            if (!modules_rollback(&res)) {
+                threads_resume(true);
+                host_unlock();
+                host_log(true, "%s, previous version failed to reload\n", why);
+                host_stop();
+                return 1;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            worker_report(false, end, timespec_diff(end, start) * 1000.0);
+
+            host.reloading = false;
+            threads_resume(true);
+            modules_commit();
+            host_unlock();
+
+            host_log(
+                true, "%s, rolled back to previous version in %.2f ms\n",
+                why, timespec_diff(end, start) * 1000.0);
+            continue;
+        }
+
+        if (reload) {
+            threads_resume(true);
+            host_unlock();
+            clock_gettime(CLOCK_MONOTONIC, &applied);
+        }
+
+        if (!--guard.calls) {
+            host_lock();
+            modules_commit();
+            worker_report(true, applied, 0.0);
+            host.reloading = false;
+            host_unlock();
+        }
+    }
+
+    // what RH_DEINIT leaves behind is not meant to be restored
+    if (res == RH_CLOSE_REQUESTED) {
+        client_checkpoint();
+    }
+
+    host_stop();
+
+    if (res == RH_CLOSE_REQUESTED) {
+        printf("%s", "client requested close, exiting");
+        res = 0;
+        while (ninit > 0) {
+            module_t *m = &modules.list[--ninit];
+            const int r = m->func(m->argc, m->argv, RH_DEINIT, &m->rh);
+            res = res ? res : r;
+        }
+    } else {
+        printf("client exited with code %d", res);
+    }
+
+    for (size_t i = 0; i < modules.n; i++) {
+        map_destroy(&modules.list[i].funcs);
+    }
 
-    return 0;
+    return res;
 }
@@ -1,15 +1,19 @@
 #pragma once
 
+#include <stddef.h>
+
 // operations for f_rh_entry
 // RH_INIT: client should initialize
 // RH_DEINIT: client should close
 // RH_STEP: client step (loop operation)
 // RH_RELOAD: client has been reloaded
+// RH_RESTORE: client should restore from persistent state (instead of RH_INIT)
 typedef enum {
     RH_INIT,
     RH_DEINIT,
     RH_STEP,
-    RH_RELOAD
+    RH_RELOAD,
+    RH_RESTORE
 } reload_host_op;
 
 // f_rh_entry returns this to request that it be called with RH_DEINIT
@@ -26,6 +30,15 @@ typedef void (*rh_regfunc_f)(void **p);
 // see reload_host::delfunc
 typedef void (*rh_delfunc_f)(void **p);
 
+// see reload_host::alloc
+typedef void *(*rh_alloc_f)(size_t n);
+
+// see reload_host::checkpoint
+typedef void (*rh_checkpoint_f)(void);
+
+// see reload_host::thread_register
+typedef void (*rh_thread_f)(void);
+
 // type of entry function in client
 typedef int (*rh_entry_f)(int, char*[], reload_host_op, reload_host_t*);
 
@@ -41,6 +54,9 @@ typedef struct reload_host {
     // reload_host->regfunc(&f->funcptr);
     //
     // now f->funcptr is properly changed on code reload
+    //
+    // reg_fn and del_fn only queue the request for the host thread, and must
+    // be called from the thread calling f_rh_entry
     rh_regfunc_f reg_fn;
 
     // see regfunc
@@ -51,5 +67,59 @@ typedef struct reload_host {
     // userdata pointer, can be used by client for arbitrary storage on reload
     // host
     void *userdata;
+
+    // allocate n bytes of persistent state, NULL if out of space or if the
+    // host was not started with a state file (-s)
+    //
+    // persistent state lives in a file-backed mapping at a fixed address and
+    // survives restarts and crashes: when the host finds an existing state
+    // file it calls f_rh_entry with RH_RESTORE instead of RH_INIT, userdata
+    // set to its value at the last checkpoint, and function pointers
+    // registered with reg_fn (which are stored in persistent state) patched
+    // for the new module. memory from alloc() is never freed.
+    rh_alloc_f alloc;
+
+    // write persistent state modified since the last checkpoint to disk. the
+    // host also checkpoints before every reload, every -c seconds and before
+    // RH_DEINIT when the client requests close. only checkpointed state is
+    // restored. ignored during RH_RELOAD and while a new version runs under
+    // fault guard, as state is rolled back to the checkpoint before its
+    // reload if it fails. must be called from the thread calling f_rh_entry.
+    rh_checkpoint_f checkpoint;
+
+    // multithreaded clients: every thread other than the one calling
+    // f_rh_entry must call thread_register() before running module code and
+    // thread_unregister() when it is done with it, and call safe_point()
+    // regularly, at points where it holds no locks the step thread may wait
+    // on.
+    //
+    // modules are only swapped (and checkpoints taken) while every registered
+    // thread is parked in safe_point(). threads keep running old code after
+    // that, at least until they return from module code, so the old module is
+    // only unloaded once every thread registered before the swap has
+    // unregistered, and a grace period (-G) has passed. a thread whose loop
+    // lives in module code keeps running the old loop: restart such threads on
+    // RH_RELOAD, with the old ones unregistering and exiting. RH_RELOAD runs
+    // while the old threads are parked in safe_point(), where they stay until
+    // it returns, so it must only tell them to stop (and may start new ones),
+    // never wait for them. join them from a later RH_STEP, or detach them. a
+    // thread that only calls into module code can unregister and register
+    // again once it no longer runs old code.
+    //
+    // a thread blocking indefinitely must unregister first, as it would
+    // otherwise stall the next reload.
+    rh_thread_f thread_register;
+
+    // see thread_register
+    rh_thread_f thread_unregister;
+
+    // see thread_register
+    rh_thread_f safe_point;
+
+    // index of this worker process when the host runs several (-w), -1
+    // otherwise. RH_INIT always runs with -1, in the supervisor process before
+    // workers are forked from it, so client threads started in RH_INIT do not
+    // exist in workers.
+    int worker;
 } reload_host_t;
 